@@ -11,9 +11,27 @@
 #include <time.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #define TEDIT_V "0.1.0"
 #define TEDIT_TAB 4
 #define TEDIT_QUIT_TIME 2
+#define TEDIT_MAX_THREADS 64
+#define TEDIT_HL_CHUNK 2048 // minimum rows per highlighting thread
+#define TEDIT_LOAD_CHUNK (1<<20) // minimum bytes per loading thread
+#define TEDIT_CACHE_MIN (1<<20) // smallest file worth a row cache
+#define TEDIT_STREAM_BLOCK (1<<20)
+#define TEDIT_STREAM_BACKLOG 64 // blocks read ahead before the reader waits
+#define TEDIT_MEMORY_MB 1024 // default resident budget before cold rows are packed
+#define TEDIT_PACK_BLOCK (64<<10) // raw bytes per packed block
+#define TEDIT_LZ_HASH 12 // log2 of the match finder's table size
+#define TEDIT_PACK_SCAN (1<<16) // rows CompactRows looks at per call
 #define HIGHLIGHT_NUMS (1<<0)
 #define HIGHLIGHT_STRING (1<<1)
 struct AppendBuffer {
@@ -46,10 +64,26 @@ typedef struct {
     int RenderSize;
     char * render;
     unsigned char * hl;
-    char * selected;
     int idx;
     int HL_OPEN_COMMENT;
+    int dirty; // modified since the last save
+    int BracketNet; // bracket depth change across the row
+    int BracketMin; // lowest depth reached within the row, relative to its start
+    int NeedsHighlight; // hl not built yet, HL_OPEN_COMMENT and bracket summary are valid
+    struct PackedBlock * packed; // chars live compressed here, render and hl are dropped
+    int PackedAt; // offset of chars in the unpacked block
+    int cost; // resident bytes counted in editor.ResidentBytes
 } EditorRow;
+typedef struct PackedBlock {
+    int refs; // rows still stored in the block
+    int rawlen;
+    int packedlen;
+    unsigned char * data;
+} PackedBlock;
+typedef struct {
+    int net;
+    int min;
+} BracketSpan;
 struct GlobalConfig {
     int cx;
     int cy;
@@ -66,6 +100,34 @@ struct GlobalConfig {
     time_t StatusTime;
     int dirty;
     SyntaxInfo * syntax;
+    long long * ByteIndex; // Fenwick tree of row lengths including the newline
+    int ByteIndexStale;
+    int FirstDirtyRow; // INT_MAX when nothing changed since the last save
+    off_t DiskSize; // -1 when the file on disk may not match the rows before FirstDirtyRow
+    struct timespec DiskMtime;
+    int StrippedCR; // loading dropped a \r, so the rows are not the bytes on disk
+    uint64_t * RowStarts; // file offset of each row from LoadFile until SaveCache writes them
+    BracketSpan * BracketTree; // segment tree of row bracket summaries
+    int BracketLeaves;
+    int BracketStale;
+    int PairRow[2]; // bracket under the cursor and its partner, -1 if none
+    int PairRx[2];
+    int SelectActive; // selection runs from SelY,SelX to the cursor
+    int SelY;
+    int SelX;
+    EditorRow * clip; // clipboard lines, only chars and size are used
+    int cliprows;
+    long long MemoryBudget; // 0 disables packing
+    long long ResidentBytes; // chars, render and hl of unpacked rows
+    long long PackedBytes;
+    int PackedRows;
+    int PackedBlocks;
+    int InBulk; // rows are being built on worker threads, see RunJobs
+    int Compacting; // went over the budget and not yet back under 3/4 of it
+    int PackCursor; // row CompactRows resumes from
+    int PackSweep; // rows looked at since anything was packed, numrows means nothing is left
+    PackedBlock * Unpacked; // block currently decompressed into UnpackedRaw
+    char * UnpackedRaw;
 };
 enum HighlightColors {
     HL_NORMAL=0,
@@ -81,6 +143,18 @@ enum HighlightColors {
     HL_MLCOMMENT
 };
 struct GlobalConfig editor;
+struct InputStream {
+    int fd;
+    int used; // buffer came from stdin
+    int active; // reader still running or data not yet appended
+    pthread_t reader;
+    pthread_mutex_t lock;
+    pthread_cond_t drained;
+    struct AppendBuffer pending; // read but not yet split, guarded by lock
+    int done; // guarded by lock
+    struct AppendBuffer carry; // partial last line
+};
+struct InputStream stream={-1,0,0,0,PTHREAD_MUTEX_INITIALIZER,PTHREAD_COND_INITIALIZER,AB_INIT,0,AB_INIT};
 char * CHighlightingExtemsopms[]={".c",".h",".cpp",".cxx",",hpp",".hxx",NULL};
 char * CHighlightingKeywords[]={
     "switch","while","for","break","continue","return","if","else","case",
@@ -119,6 +193,11 @@ SyntaxInfo HighlightDatabase[] = {
 void TildeColumn(struct AppendBuffer * ab);
 void SaveFile(void);
 void SetStatusMsg(const char *fmt,...);
+void FindBracketPair(void);
+int StreamPoll(void);
+void ThawRow(EditorRow * row);
+void CompactRows(void);
+void PackRows(int a, int b);
 #define ctrl(k) ((k) & 0x1f)
 int CharsToRender(EditorRow * row,int cx) {
     int rx=0;
@@ -139,9 +218,68 @@ int RenderToChars(EditorRow *row, int rx) {
   }
   return cx;
 }
+// keep editor.ResidentBytes in step with what the row holds
+void AccountRow(EditorRow * row) {
+    int cost=(row->chars?row->size+1:0)+(row->render?row->RenderSize+1:0)+(row->hl?row->RenderSize:0);
+    if (!editor.InBulk) editor.ResidentBytes+=cost-row->cost;
+    row->cost=cost;
+}
+// what the budget is measured against: row buffers plus the row table itself
+long long MemoryInUse(void) {
+    return editor.ResidentBytes+(long long)editor.numrows*sizeof(EditorRow);
+}
+long long RowsCost(int from, int to) {
+    long long sum=0;
+    for (int j=from;j<to;j++) sum+=editor.row[j].cost;
+    return sum;
+}
+void IndexAdd(int at, long long delta) {
+    for (int i=at+1;i<=editor.numrows;i+=i&-i) editor.ByteIndex[i]+=delta;
+}
+void IndexRebuild(void) {
+    editor.ByteIndex=realloc(editor.ByteIndex,sizeof(long long)*(editor.numrows+1));
+    editor.ByteIndex[0]=0;
+    for (int i=1;i<=editor.numrows;i++) editor.ByteIndex[i]=editor.row[i-1].size+1;
+    for (int i=1;i<=editor.numrows;i++) {
+        int j=i+(i&-i);
+        if (j<=editor.numrows) editor.ByteIndex[j]+=editor.ByteIndex[i];
+    }
+    editor.ByteIndexStale=0;
+}
+// byte offset of the start of row at, counting one \n per row as the buffer is saved;
+// rows past the end all start at the end of the buffer
+long long RowByteOffset(int at) {
+    if (editor.ByteIndexStale) IndexRebuild();
+    if (at>editor.numrows) at=editor.numrows;
+    long long sum=0;
+    for (int i=at;i>0;i-=i&-i) sum+=editor.ByteIndex[i];
+    return sum;
+}
+// row containing byte offset off, or numrows past the end of the buffer
+int RowAtByteOffset(long long off) {
+    if (editor.ByteIndexStale) IndexRebuild();
+    int pos=0;
+    int step=1;
+    while (step*2<=editor.numrows) step*=2;
+    for (;step;step/=2) {
+        if (pos+step<=editor.numrows && editor.ByteIndex[pos+step]<=off) {
+            pos+=step;
+            off-=editor.ByteIndex[pos];
+        }
+    }
+    return pos;
+}
+// structural edits mark the index stale, in-place edits adjust it in O(log n)
+void IndexUpdateRow(EditorRow * row) {
+    if (editor.ByteIndexStale || row->idx>=editor.numrows) return;
+    IndexAdd(row->idx,row->size+1-(RowByteOffset(row->idx+1)-RowByteOffset(row->idx)));
+}
 void ScrollScreen(void) {
     editor.rx=editor.cx;
-    if (editor.cy<editor.numrows) editor.rx=CharsToRender(&editor.row[editor.cy],editor.cx);
+    if (editor.cy<editor.numrows) {
+        ThawRow(&editor.row[editor.cy]);
+        editor.rx=CharsToRender(&editor.row[editor.cy],editor.cx);
+    }
     if (editor.cy<editor.RowOffset) editor.RowOffset=editor.cy;
     if (editor.cy>editor.RowOffset+editor.screenrows) editor.RowOffset=editor.cy-editor.screenrows-1;
     if (editor.cx<editor.ColumnOffset) editor.ColumnOffset=editor.rx;
@@ -150,8 +288,10 @@ void ScrollScreen(void) {
 void DrawStatusBar(struct AppendBuffer * ab) {
     AppendAB(ab,"\x1b[7m",4);
     char status[80],rstatus[80];
-    int len=snprintf(status,sizeof(status),"%.20s - %d lines %s",editor.filename?editor.filename:"[New File]",editor.numrows,editor.dirty?"(modified)":"");
-    int rlen=snprintf(rstatus,sizeof(rstatus),"%s line %d",editor.syntax?editor.syntax->filetype:"No Filetype",editor.cy+1);
+    char * name=editor.filename?editor.filename:stream.used?"[stdin]":"[New File]";
+    int len=snprintf(status,sizeof(status),"%.20s - %d lines %s%s",name,editor.numrows,editor.dirty?"(modified) ":"",stream.active?"(loading)":"");
+    long long offset=RowByteOffset(editor.cy)+(editor.cy<editor.numrows?editor.cx:0);
+    int rlen=snprintf(rstatus,sizeof(rstatus),"%s line %d buf byte %lld",editor.syntax?editor.syntax->filetype:"No Filetype",editor.cy+1,offset);
     if (len>editor.screencols) len=editor.screencols;
     AppendAB(ab,status,len);
     while (len<editor.screencols) {
@@ -174,6 +314,7 @@ void DrawSecondBar(struct AppendBuffer * ab) {
 }
 void refresh() {
     ScrollScreen();
+    FindBracketPair();
     struct AppendBuffer _ab = AB_INIT;
     AppendAB(&_ab, "\x1b[?25l", 6);
     AppendAB(&_ab,"\x1b[H", 3);
@@ -234,6 +375,8 @@ int ReadKey(void) {
     char cur;
     while ((retcode = read(STDIN_FILENO, &cur, 1)) != 1) {
         if (retcode == -1 && errno != EAGAIN) die("read");
+        if (StreamPoll()) refresh();
+        CompactRows(); // carry on packing while waiting for keys
     }
     if (cur == '\x1b') {
         char seq[3];
@@ -277,10 +420,62 @@ int ReadKey(void) {
 int IsSeperator(int c) {
     return isspace(c) || c=='\0' || strchr(",.()+-/*+~%<>[];",c)!=NULL;
 }
-void UpdateSyntax(EditorRow * row) {
+int BracketDelta(int c) {
+    switch (c) {
+        case '(': case '[': case '{': return 1;
+        case ')': case ']': case '}': return -1;
+        default: return 0;
+    }
+}
+// depth change of the bracket at rx, ignoring those the highlighter put in strings or comments
+int BracketAt(EditorRow * row, int rx) {
+    if (rx<0 || rx>=row->RenderSize) return 0;
+    if (editor.syntax && row->hl[rx]!=HL_BRACKET) return 0;
+    return BracketDelta(row->render[rx]);
+}
+BracketSpan JoinSpans(BracketSpan a, BracketSpan b) {
+    BracketSpan r={a.net+b.net,a.net+b.min<a.min?a.net+b.min:a.min};
+    return r;
+}
+void BracketRebuild(void) {
+    int leaves=1;
+    while (leaves<editor.numrows) leaves*=2;
+    editor.BracketTree=realloc(editor.BracketTree,sizeof(BracketSpan)*2*leaves);
+    editor.BracketLeaves=leaves;
+    for (int i=0;i<leaves;i++) {
+        BracketSpan leaf={0,0};
+        if (i<editor.numrows) leaf.net=editor.row[i].BracketNet,leaf.min=editor.row[i].BracketMin;
+        editor.BracketTree[leaves+i]=leaf;
+    }
+    for (int i=leaves-1;i>0;i--) editor.BracketTree[i]=JoinSpans(editor.BracketTree[2*i],editor.BracketTree[2*i+1]);
+    editor.BracketStale=0;
+}
+void SummarizeBrackets(EditorRow * row) {
+    int depth=0;
+    int min=0;
+    for (int i=0;i<row->RenderSize;i++) {
+        depth+=BracketAt(row,i);
+        if (depth<min) min=depth;
+    }
+    row->BracketNet=depth;
+    row->BracketMin=min;
+    // bulk passes mark the tree stale first, so only single-row updates land here
+    if (editor.BracketStale || row->idx>=editor.numrows) return;
+    int i=editor.BracketLeaves+row->idx;
+    editor.BracketTree[i].net=depth;
+    editor.BracketTree[i].min=min;
+    for (i/=2;i>0;i/=2) editor.BracketTree[i]=JoinSpans(editor.BracketTree[2*i],editor.BracketTree[2*i+1]);
+}
+int HighlightRow(EditorRow * row, int incomment) {
+    ThawRow(row);
+    row->NeedsHighlight=0;
     row->hl=realloc(row->hl,row->RenderSize);
     memset(row->hl,HL_NORMAL,row->RenderSize);
-    if (editor.syntax==NULL) return;
+    AccountRow(row);
+    if (editor.syntax==NULL) {
+        SummarizeBrackets(row);
+        return 0;
+    }
     char ** keywords=editor.syntax->keywords;
     char * scs=editor.syntax->SingleLineCommentStart;
     char * mcs=editor.syntax->MultilineStart;
@@ -291,7 +486,6 @@ void UpdateSyntax(EditorRow * row) {
     int prevsep=1;
     int prevdig=0;
     int instring=0;
-    int incomment=(row->idx > 0 && editor.row[row->idx - 1].HL_OPEN_COMMENT);
     for (int i=0;i<row->RenderSize;i++) {
         
         unsigned char PreviousHighlight=i>0?row->hl[i-1]:HL_NORMAL;
@@ -376,10 +570,186 @@ void UpdateSyntax(EditorRow * row) {
         prevsep=IsSeperator(row->render[i]);
         prevdig=isdigit(row->render[i]) || ((prevdig) && row->render[i]=='x');
     }
+    SummarizeBrackets(row);
     int changed=(row->HL_OPEN_COMMENT!=incomment);
     row->HL_OPEN_COMMENT=incomment;
+    return changed;
+}
+// rows restored from the cache or unpacked are lexed only once they are drawn or searched
+void EnsureHighlight(EditorRow * row) {
+    ThawRow(row);
+    if (row->NeedsHighlight) HighlightRow(row,row->idx > 0 && editor.row[row->idx - 1].HL_OPEN_COMMENT);
+}
+void UpdateSyntax(EditorRow * row) {
+    int changed=HighlightRow(row,row->idx > 0 && editor.row[row->idx - 1].HL_OPEN_COMMENT);
     if (changed && row->idx+1<editor.numrows) UpdateSyntax(&editor.row[row->idx+1]);
 }
+int WorkerCount(int units) {
+    char * env=getenv("TEDIT_THREADS");
+    long n=env?atol(env):sysconf(_SC_NPROCESSORS_ONLN);
+    if (n<1) n=1;
+    if (n>TEDIT_MAX_THREADS) n=TEDIT_MAX_THREADS;
+    if (n>units) n=units;
+    return n<1?1:n;
+}
+// run worker over n jobs of jobsize bytes each, the first on this thread
+void RunJobs(void * (*worker)(void *), void * jobs, size_t jobsize, int n) {
+    pthread_t threads[TEDIT_MAX_THREADS];
+    char * job=jobs;
+    int spawned=1;
+    editor.InBulk=1; // callers add up the rows' cost afterwards
+    while (spawned<n && pthread_create(&threads[spawned],NULL,worker,job+spawned*jobsize)==0) spawned++;
+    for (int t=spawned;t<n;t++) worker(job+t*jobsize); // could not spawn, do it here
+    worker(job);
+    for (int t=1;t<spawned;t++) pthread_join(threads[t],NULL);
+    editor.InBulk=0;
+}
+struct HighlightJob {
+    int start;
+    int end;
+};
+void * HighlightWorker(void * arg) {
+    struct HighlightJob * job=arg;
+    int incomment=0; // assume no comment is open at the start of the chunk
+    for (int i=job->start;i<job->end;i++) {
+        HighlightRow(&editor.row[i],incomment);
+        incomment=editor.row[i].HL_OPEN_COMMENT;
+    }
+    return NULL;
+}
+// lex rows from..to-1 on all cores, carrying on from the state the row before from ended in
+void HighlightRange(int from, int to) {
+    struct HighlightJob jobs[TEDIT_MAX_THREADS];
+    int n=WorkerCount((to-from)/TEDIT_HL_CHUNK);
+    for (int t=0;t<n;t++) {
+        jobs[t].start=from+(long long)(to-from)*t/n;
+        jobs[t].end=from+(long long)(to-from)*(t+1)/n;
+    }
+    editor.ResidentBytes-=RowsCost(from,to);
+    RunJobs(HighlightWorker,jobs,sizeof(jobs[0]),n);
+    editor.ResidentBytes+=RowsCost(from,to);
+    // fix up chunks whose real starting state was an open comment, in order, stopping
+    // as soon as a row ends in the same state it had when lexed with the wrong start
+    for (int t=0;t<n;t++) {
+        int assumed=0;
+        for (int i=jobs[t].start;i<jobs[t].end && i>0;i++) {
+            int actual=editor.row[i-1].HL_OPEN_COMMENT;
+            if (actual==assumed) break;
+            assumed=editor.row[i].HL_OPEN_COMMENT;
+            HighlightRow(&editor.row[i],actual);
+        }
+    }
+}
+void HighlightAllRows(void) {
+    editor.BracketStale=1;
+    if (editor.PackedRows==0) {
+        HighlightRange(0,editor.numrows);
+        return;
+    }
+    // packed rows are thawed, lexed for their comment state and bracket summary and
+    // packed again a window at a time, so the buffer stays near the budget
+    char * packed=NULL;
+    for (int from=0,to;from<editor.numrows;from=to) {
+        long long raw=0;
+        for (to=from;to<editor.numrows && (to==from || raw<editor.MemoryBudget/8);to++) raw+=editor.row[to].size;
+        packed=realloc(packed,to-from);
+        for (int i=from;i<to;i++) {
+            packed[i-from]=editor.row[i].packed!=NULL;
+            ThawRow(&editor.row[i]);
+        }
+        HighlightRange(from,to);
+        for (int i=from,start=-1,rawlen=0;i<=to;i++) {
+            int again=i<to && packed[i-from];
+            if (start!=-1 && (!again || rawlen+editor.row[i].size>TEDIT_PACK_BLOCK)) {
+                PackRows(start,i);
+                start=-1;
+            }
+            if (!again) continue;
+            if (start==-1) start=i,rawlen=0;
+            rawlen+=editor.row[i].size;
+        }
+    }
+    free(packed);
+}
+// first row at or after from in which the depth, starting at *depth, drops below zero
+int BracketSearchForward(int node, int lo, int hi, int from, int * depth) {
+    if (hi<=from) return -1;
+    BracketSpan span=editor.BracketTree[node];
+    if (lo>=from && *depth+span.min>=0) {
+        *depth+=span.net;
+        return -1;
+    }
+    if (hi-lo==1) return lo;
+    int mid=(lo+hi)/2;
+    int r=BracketSearchForward(2*node,lo,mid,from,depth);
+    return r!=-1?r:BracketSearchForward(2*node+1,mid,hi,from,depth);
+}
+// last row before to that holds an unmatched opener, scanning right to left from *depth
+int BracketSearchBackward(int node, int lo, int hi, int to, int * depth) {
+    if (lo>=to) return -1;
+    BracketSpan span=editor.BracketTree[node];
+    if (hi<=to && *depth+span.net-span.min<1) {
+        *depth+=span.net;
+        return -1;
+    }
+    if (hi-lo==1) return lo;
+    int mid=(lo+hi)/2;
+    int r=BracketSearchBackward(2*node+1,mid,hi,to,depth);
+    return r!=-1?r:BracketSearchBackward(2*node,lo,mid,to,depth);
+}
+int MatchBracket(int y, int rx, int * my, int * mrx) {
+    if (y<0 || y>=editor.numrows) return 0;
+    EditorRow * row=&editor.row[y];
+    EnsureHighlight(row);
+    int d=BracketAt(row,rx);
+    if (d==0) return 0;
+    if (editor.BracketStale) BracketRebuild();
+    int depth=0;
+    if (d>0) {
+        for (int i=rx+1;i<row->RenderSize;i++) {
+            depth+=BracketAt(row,i);
+            if (depth<0) return *my=y,*mrx=i,1;
+        }
+        y=BracketSearchForward(1,0,editor.BracketLeaves,y+1,&depth);
+        if (y==-1) return 0;
+        row=&editor.row[y];
+        EnsureHighlight(row);
+        for (int i=0;i<row->RenderSize;i++) {
+            depth+=BracketAt(row,i);
+            if (depth<0) return *my=y,*mrx=i,1;
+        }
+    } else {
+        for (int i=rx-1;i>=0;i--) {
+            depth+=BracketAt(row,i);
+            if (depth>0) return *my=y,*mrx=i,1;
+        }
+        y=BracketSearchBackward(1,0,editor.BracketLeaves,y,&depth);
+        if (y==-1) return 0;
+        row=&editor.row[y];
+        EnsureHighlight(row);
+        for (int i=row->RenderSize-1;i>=0;i--) {
+            depth+=BracketAt(row,i);
+            if (depth>0) return *my=y,*mrx=i,1;
+        }
+    }
+    return 0;
+}
+void FindBracketPair(void) {
+    editor.PairRow[0]=editor.PairRow[1]=-1;
+    if (MatchBracket(editor.cy,editor.rx,&editor.PairRow[1],&editor.PairRx[1])) {
+        editor.PairRow[0]=editor.cy;
+        editor.PairRx[0]=editor.rx;
+    }
+}
+void JumpToBracket(void) {
+    int y,rx;
+    if (!MatchBracket(editor.cy,editor.rx,&y,&rx)) {
+        SetStatusMsg("No matching bracket");
+        return;
+    }
+    editor.cy=y;
+    editor.cx=RenderToChars(&editor.row[y],rx);
+}
 int SyntaxToColor(int hl) {
     switch (hl) {
         case HL_NUMBER: return 31;
@@ -395,31 +765,27 @@ int SyntaxToColor(int hl) {
         default: return 37;
     }
 }
-void SelectSyntaxHighlighter(void) {
-    editor.syntax=NULL;
-    if (editor.filename==NULL) return;
+SyntaxInfo * SyntaxForFilename(char * filename) {
+    if (filename==NULL) return NULL;
     for (unsigned int j=0;j<HighlightDBEntries;j++) {
         SyntaxInfo * s=&HighlightDatabase[j];
         unsigned int i=0;
         while (s->filematch[i]) {
-            char * p=strstr(editor.filename,s->filematch[i]);
+            char * p=strstr(filename,s->filematch[i]);
             int patlen=strlen(s->filematch[i]);
             if (p!=NULL) {
-                if (s->filematch[i][0] != '.'|| (p[patlen]=='\0')) {
-                    editor.syntax=s;
-                    for (int fr=0;fr<editor.numrows;fr++) {
-                        UpdateSyntax(&editor.row[fr]);
-                    }
-                    return;
-                }
+                if (s->filematch[i][0] != '.'|| (p[patlen]=='\0')) return s;
             }
             i++;
         }
     }
-    editor.syntax=NULL;
-    return;
+    return NULL;
 }
-void UpdateRow(EditorRow * row) {
+void SelectSyntaxHighlighter(void) {
+    editor.syntax=SyntaxForFilename(editor.filename);
+    if (editor.syntax) HighlightAllRows();
+}
+void RenderRow(EditorRow * row) {
     int tabs=0;
     for (int i=0;i<row->size;i++) {
         if (row->chars[i]=='\t') tabs++;
@@ -437,67 +803,285 @@ void UpdateRow(EditorRow * row) {
     }
     row->render[idx]=0;
     row->RenderSize=idx;
+    AccountRow(row);
+}
+void UpdateRow(EditorRow * row) {
+    RenderRow(row);
+    IndexUpdateRow(row);
     UpdateSyntax(row);
 }
+void InitRow(EditorRow * row, int at, char * s, size_t len) {
+    row->idx=at;
+    row->size=len;
+    row->chars=malloc(len + 1);
+    memcpy(row->chars,s,len);
+    row->chars[len]='\0';
+    row->RenderSize=0;
+    row->render=NULL;
+    row->hl=NULL;
+    row->HL_OPEN_COMMENT=0;
+    row->dirty=0;
+    row->NeedsHighlight=0;
+    row->packed=NULL;
+    row->cost=0;
+}
+void MarkRowDirty(int at) {
+    if (at<editor.numrows) editor.row[at].dirty=1;
+    if (at<editor.FirstDirtyRow) editor.FirstDirtyRow=at;
+}
 void NewRow(int at, char * s,size_t len) {
     if (at<0 || at > editor.numrows) return;
     editor.row=realloc((void *)editor.row,sizeof(EditorRow)*(editor.numrows+1));
     memmove(&editor.row[at+1],&editor.row[at],sizeof(EditorRow)*(editor.numrows-at));
     for (int j = at + 1; j <= editor.numrows; j++) editor.row[j].idx++;
-    editor.row[at].idx=at;
-    editor.row[at].size=len;
-    editor.row[at].chars=malloc(len + 1);
-    memcpy(editor.row[at].chars,s,len);
-    editor.row[at].chars[len]='\0';
-    editor.row[at].RenderSize=0;
-    editor.row[at].render=NULL;
-    editor.row[at].hl=NULL;  
-    editor.row[at].HL_OPEN_COMMENT=0;  
+    editor.ByteIndexStale=1;
+    editor.BracketStale=1;
+    InitRow(&editor.row[at],at,s,len);
     UpdateRow(&editor.row[at]);
     editor.numrows++;
+    MarkRowDirty(at);
     editor.dirty++;
 }
+void ReleaseBlock(PackedBlock * blk);
 void FreeRow(EditorRow * row) {
     free(row->render);
     free(row->chars);
     free(row->hl);
+    if (row->packed) ReleaseBlock(row->packed);
+    editor.ResidentBytes-=row->cost;
+}
+void FreeRows(void) {
+    for (int j=0;j<editor.numrows;j++) FreeRow(&editor.row[j]);
+    free(editor.row);
+    editor.row=NULL;
+    editor.numrows=0;
+    editor.ByteIndexStale=1;
+    editor.BracketStale=1;
+}
+int LzBound(int n) {
+    return n+n/255+16;
+}
+int LzLength(unsigned char * dst, int out, int len) {
+    for (;len>=255;len-=255) dst[out++]=255;
+    dst[out++]=len;
+    return out;
+}
+// one LZ4-style sequence: token, literals, then a 16 bit offset unless it is the last
+int LzSequence(unsigned char * dst, int out, const unsigned char * lit, int litlen, int offset, int matchlen) {
+    int m=matchlen?matchlen-4:0;
+    dst[out++]=((litlen<15?litlen:15)<<4) | (m<15?m:15);
+    if (litlen>=15) out=LzLength(dst,out,litlen-15);
+    memcpy(&dst[out],lit,litlen);
+    out+=litlen;
+    if (matchlen) {
+        dst[out++]=offset&0xff;
+        dst[out++]=offset>>8;
+        if (m>=15) out=LzLength(dst,out,m-15);
+    }
+    return out;
+}
+int LzCompress(const unsigned char * src, int n, unsigned char * dst) {
+    int table[1<<TEDIT_LZ_HASH];
+    for (int i=0;i<(1<<TEDIT_LZ_HASH);i++) table[i]=-1;
+    int anchor=0,out=0,i=0;
+    while (i+4<=n) {
+        uint32_t v;
+        memcpy(&v,&src[i],4);
+        uint32_t h=(v*2654435761U)>>(32-TEDIT_LZ_HASH);
+        int ref=table[h];
+        table[h]=i;
+        if (ref<0 || i-ref>65535 || memcmp(&src[ref],&src[i],4)) {
+            i++;
+            continue;
+        }
+        int len=4;
+        while (i+len<n && src[ref+len]==src[i+len]) len++;
+        out=LzSequence(dst,out,&src[anchor],i-anchor,i-ref,len);
+        i+=len;
+        anchor=i;
+    }
+    return LzSequence(dst,out,&src[anchor],n-anchor,0,0);
+}
+int LzDecompress(const unsigned char * src, int n, unsigned char * dst) {
+    int ip=0,op=0;
+    while (ip<n) {
+        int token=src[ip++];
+        int lit=token>>4;
+        if (lit==15) {
+            int b;
+            do { b=src[ip++]; lit+=b; } while (b==255);
+        }
+        memcpy(&dst[op],&src[ip],lit);
+        ip+=lit;
+        op+=lit;
+        if (ip>=n) break;
+        int offset=src[ip] | (src[ip+1]<<8);
+        ip+=2;
+        int len=token&15;
+        if (len==15) {
+            int b;
+            do { b=src[ip++]; len+=b; } while (b==255);
+        }
+        for (len+=4;len>0;len--,op++) dst[op]=dst[op-offset];
+    }
+    return op;
+}
+char * UnpackBlock(PackedBlock * blk) {
+    if (editor.Unpacked!=blk) {
+        editor.UnpackedRaw=realloc(editor.UnpackedRaw,blk->rawlen?blk->rawlen:1);
+        LzDecompress(blk->data,blk->packedlen,(unsigned char *)editor.UnpackedRaw);
+        editor.Unpacked=blk;
+    }
+    return editor.UnpackedRaw;
+}
+void ReleaseBlock(PackedBlock * blk) {
+    editor.PackedRows--;
+    if (--blk->refs) return;
+    if (editor.Unpacked==blk) editor.Unpacked=NULL;
+    editor.PackedBytes-=blk->packedlen;
+    editor.PackedBlocks--;
+    free(blk->data);
+    free(blk);
+}
+// the row's chars, straight from the block cache for packed rows; valid until the next unpack
+char * RowChars(EditorRow * row) {
+    return row->packed?UnpackBlock(row->packed)+row->PackedAt:row->chars;
+}
+void ThawRow(EditorRow * row) {
+    if (row->packed==NULL) return;
+    row->chars=malloc(row->size+1);
+    memcpy(row->chars,RowChars(row),row->size);
+    row->chars[row->size]='\0';
+    ReleaseBlock(row->packed);
+    row->packed=NULL;
+    RenderRow(row);
+    row->NeedsHighlight=1;
+    editor.PackSweep=0;
+}
+// compress rows a..b-1 into one block and drop their render and hl
+void PackRows(int a, int b) {
+    int rawlen=0;
+    for (int j=a;j<b;j++) rawlen+=editor.row[j].size;
+    unsigned char * raw=malloc(rawlen?rawlen:1);
+    for (int j=a,at=0;j<b;at+=editor.row[j].size,j++) memcpy(&raw[at],editor.row[j].chars,editor.row[j].size);
+    PackedBlock * blk=malloc(sizeof(PackedBlock));
+    blk->data=malloc(LzBound(rawlen));
+    blk->packedlen=LzCompress(raw,rawlen,blk->data);
+    blk->data=realloc(blk->data,blk->packedlen?blk->packedlen:1);
+    blk->rawlen=rawlen;
+    blk->refs=b-a;
+    free(raw);
+    for (int j=a,at=0;j<b;j++) {
+        EditorRow * row=&editor.row[j];
+        free(row->chars);
+        free(row->render);
+        free(row->hl);
+        row->chars=row->render=NULL;
+        row->hl=NULL;
+        row->RenderSize=0;
+        row->NeedsHighlight=1;
+        row->packed=blk;
+        row->PackedAt=at;
+        at+=row->size;
+        AccountRow(row);
+    }
+    editor.PackedBytes+=blk->packedlen;
+    editor.PackedRows+=b-a;
+    editor.PackedBlocks++;
+}
+// pack unmodified rows away from the screen until we are well under the budget, looking
+// at no more than TEDIT_PACK_SCAN rows per call and resuming where the last call stopped
+void CompactRows(void) {
+    long long target=editor.MemoryBudget/4*3;
+    if (editor.MemoryBudget==0 || MemoryInUse()<=target) {
+        editor.Compacting=0;
+        return;
+    }
+    if (!editor.Compacting && MemoryInUse()<=editor.MemoryBudget) return;
+    editor.Compacting=1;
+    if (editor.PackSweep>=editor.numrows) return; // every row is packed, dirty or on screen
+    int top=editor.cy<editor.RowOffset?editor.cy:editor.RowOffset;
+    int bottom=editor.cy>editor.RowOffset+editor.screenrows?editor.cy:editor.RowOffset+editor.screenrows;
+    int lo=top-editor.screenrows*2;
+    int hi=bottom+editor.screenrows*2;
+    int start=-1,rawlen=0;
+    if (editor.PackCursor>=editor.numrows) editor.PackCursor=0;
+    for (int scanned=0;scanned<TEDIT_PACK_SCAN && editor.PackSweep<editor.numrows && MemoryInUse()>target;scanned++) {
+        int j=editor.PackCursor;
+        EditorRow * row=&editor.row[j];
+        int cold=!row->packed && !row->dirty && (j<lo || j>hi);
+        if (start!=-1 && (!cold || rawlen+row->size>TEDIT_PACK_BLOCK)) {
+            PackRows(start,j);
+            editor.PackSweep=0;
+            start=-1;
+        }
+        if (cold) {
+            if (start==-1) start=j,rawlen=0;
+            rawlen+=row->size;
+        }
+        editor.PackSweep++;
+        if (++editor.PackCursor==editor.numrows) {
+            if (start!=-1) PackRows(start,editor.numrows),editor.PackSweep=0;
+            start=-1;
+            editor.PackCursor=0;
+        }
+    }
+    if (start!=-1) {
+        PackRows(start,editor.PackCursor);
+        editor.PackSweep=0;
+    }
+}
+void ShowMemoryStats(void) {
+    SetStatusMsg("%.1f MB resident (%.1f MB row table), %d rows packed into %.1f MB in %d blocks, budget %lld MB",
+        MemoryInUse()/1048576.0,editor.numrows*sizeof(EditorRow)/1048576.0,editor.PackedRows,
+        editor.PackedBytes/1048576.0,editor.PackedBlocks,editor.MemoryBudget>>20);
 }
 void DeleteRow(int at) {
     if (at<0 || at>=editor.numrows) return;
     FreeRow(&editor.row[at]);
     memmove(&editor.row[at], &editor.row[at + 1], sizeof(EditorRow) * (editor.numrows - at - 1));
     for (int j = at; j < editor.numrows - 1; j++) editor.row[j].idx--;
+    editor.ByteIndexStale=1;
+    editor.BracketStale=1;
     editor.numrows--;
+    if (at<editor.FirstDirtyRow) editor.FirstDirtyRow=at;
     editor.dirty++;
 }
 void RowInsertChar(EditorRow * row, int at, int c) {
+    ThawRow(row);
     if (at<0 || at>row->size) at=row->size;
     row->chars=realloc(row->chars,row->size+2);
     memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
     row->size++;
     row->chars[at]=c;
     UpdateRow(row);
+    MarkRowDirty(row->idx);
     editor.dirty++;
 }
 void RowDeleteChar(EditorRow * row, int at) {
+    ThawRow(row);
     if (at<0 || at>=row->size) return;
     memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
     row->size--;
     UpdateRow(row);
+    MarkRowDirty(row->idx);
     editor.dirty++;
 }
 void RowAppendString(EditorRow * row,char * s, size_t len) {
+    ThawRow(row);
     row->chars = realloc(row->chars, row->size + len + 1);
     memcpy(&row->chars[row->size], s, len);
     row->size += len;
     row->chars[row->size] = '\0';
     UpdateRow(row);
+    MarkRowDirty(row->idx);
     editor.dirty++;
 }
 void DeleteChar(void) {
     if (editor.cy==editor.numrows) return;
     if (editor.cx==0 && editor.cy==0) return;
     EditorRow *row = &editor.row[editor.cy];
+    ThawRow(row);
     if (editor.cx > 0) {
         RowDeleteChar(row, editor.cx - 1);
         editor.cx--;
@@ -517,15 +1101,18 @@ void InsertNewline(void) {
     if (editor.cx==0) NewRow(editor.cy,"",0);
     else {
         EditorRow * row=&editor.row[editor.cy];
-        row=&editor.row[editor.cy];
+        ThawRow(row);
         row->size=editor.cx;
         row->chars[row->size]='\0';
         UpdateRow(row);
+        MarkRowDirty(editor.cy);
+        editor.dirty++;
     }
     editor.cy++;
     editor.cx=0;
 }
-char * PromptUser(char * prompt, void (*callback)(char *, int)) {
+// AllowEmpty lets Enter accept an empty answer, e.g. replacing matches with nothing
+char * PromptInput(char * prompt, void (*callback)(char *, int), int AllowEmpty) {
     size_t bufsize=128;
     char * buf=malloc(bufsize);
     size_t buflen=0;
@@ -542,7 +1129,7 @@ char * PromptUser(char * prompt, void (*callback)(char *, int)) {
             free(buf);
             return NULL;
         } else if (c=='\r') {
-            if (buflen!=0) {
+            if (buflen!=0 || AllowEmpty) {
                 SetStatusMsg("");
                 if (callback) callback(buf,c);
                 return buf;
@@ -558,6 +1145,9 @@ char * PromptUser(char * prompt, void (*callback)(char *, int)) {
         if (callback) callback(buf,c);
     }
 }
+char * PromptUser(char * prompt, void (*callback)(char *, int)) {
+    return PromptInput(prompt,callback,0);
+}
 void MoveCursor(int key) {
     EditorRow * row=(editor.cy>=editor.numrows)?NULL:&editor.row[editor.cy];
     switch (key) {
@@ -582,6 +1172,15 @@ void MoveCursor(int key) {
         editor.cx=rowlen;
     }
 }
+int FindInRow(char * s, int len, char * query, int qlen, int from) {
+    while (from+qlen<=len) {
+        char * p=memchr(&s[from],query[0],len-qlen-from+1);
+        if (p==NULL) return -1;
+        if (!memcmp(p,query,qlen)) return p-s;
+        from=p-s+1;
+    }
+    return -1;
+}
 void FindStrCallback(char * query, int key) {
     static int LastMatch=-1;
     static int direction=1;
@@ -613,6 +1212,13 @@ void FindStrCallback(char * query, int key) {
         if (current==-1) current=editor.numrows-1;
         else if (current==editor.numrows) current=0;
         EditorRow * row=&editor.row[current];
+        if (row->packed) {
+            // only unpack rows that can match, render differs from chars just by tabs turned into spaces
+            char * chars=RowChars(row);
+            int plain=!strchr(query,' ') || !memchr(chars,'\t',row->size);
+            if (*query && plain && FindInRow(chars,row->size,query,strlen(query),0)==-1) continue;
+            ThawRow(row);
+        }
         char * match=strstr(row->render,query);
         if (match) {
             LastMatch=current;
@@ -620,6 +1226,7 @@ void FindStrCallback(char * query, int key) {
             editor.cx=RenderToChars(row,match-row->render);
             editor.RowOffset=editor.numrows;
             SaveHighlightLine=current;
+            EnsureHighlight(row);
             SavedHighlight=malloc(row->RenderSize);
             memcpy(SavedHighlight,row->hl,row->RenderSize);
             memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
@@ -633,6 +1240,230 @@ void FindStr(void) {
         free(query);
     }
 }
+// relex rows first..last (only the touched ones if touched is given), then carry on
+// past last while the open-comment state a row was lexed with has changed
+void RehighlightRows(int first, int last, char * touched) {
+    int lexedwith=first>0?editor.row[first-1].HL_OPEN_COMMENT:0;
+    for (int i=first;i<editor.numrows;i++) {
+        int start=i>0?editor.row[i-1].HL_OPEN_COMMENT:0;
+        int next=editor.row[i].HL_OPEN_COMMENT;
+        if ((i<=last && (!touched || touched[i])) || start!=lexedwith) HighlightRow(&editor.row[i],start);
+        else if (i>last) break;
+        lexedwith=next;
+    }
+}
+long long ReplaceInRows(char * query, char * with) {
+    int qlen=strlen(query);
+    int wlen=strlen(with);
+    char * touched=calloc(editor.numrows,1);
+    long long count=0;
+    int first=-1,last=-1;
+    for (int i=0;i<editor.numrows;i++) {
+        EditorRow * row=&editor.row[i];
+        int matches=0;
+        char * old=RowChars(row);
+        for (int at=FindInRow(old,row->size,query,qlen,0);at!=-1;at=FindInRow(old,row->size,query,qlen,at+qlen)) matches++;
+        if (matches==0) continue;
+        ThawRow(row);
+        int size=row->size+matches*(wlen-qlen);
+        char * chars=malloc(size+1);
+        char * p=chars;
+        int from=0;
+        for (int at=FindInRow(row->chars,row->size,query,qlen,0);at!=-1;at=FindInRow(row->chars,row->size,query,qlen,at+qlen)) {
+            memcpy(p,&row->chars[from],at-from);
+            p+=at-from;
+            memcpy(p,with,wlen);
+            p+=wlen;
+            from=at+qlen;
+        }
+        memcpy(p,&row->chars[from],row->size-from);
+        chars[size]='\0';
+        free(row->chars);
+        row->chars=chars;
+        row->size=size;
+        RenderRow(row);
+        IndexUpdateRow(row);
+        MarkRowDirty(i);
+        touched[i]=1;
+        if (first==-1) first=i;
+        last=i;
+        count+=matches;
+    }
+    if (count) {
+        RehighlightRows(first,last,touched);
+        editor.dirty++;
+        if (editor.cy<editor.numrows && editor.cx>editor.row[editor.cy].size) editor.cx=editor.row[editor.cy].size;
+    }
+    free(touched);
+    return count;
+}
+void ReplaceAll(void) {
+    char * query=PromptUser("Replace: %s (ESC to cancel)",NULL);
+    if (query==NULL) return;
+    char * with=PromptInput("Replace with: %s (ESC to cancel)",NULL,1);
+    if (with==NULL) {
+        free(query);
+        return;
+    }
+    long long count=ReplaceInRows(query,with);
+    SetStatusMsg("Replaced %lld occurrence%s of \"%s\"",count,count==1?"":"s",query);
+    free(query);
+    free(with);
+}
+void GotoLine(void) {
+    char * answer=PromptUser("Go to line: %s (ESC to cancel)",NULL);
+    if (answer==NULL) return;
+    long line=atol(answer);
+    free(answer);
+    if (line<1) line=1;
+    if (line>editor.numrows) line=editor.numrows;
+    editor.cy=line>0?line-1:0;
+    editor.cx=0;
+    editor.RowOffset=editor.numrows;
+}
+void GotoOffset(void) {
+    char * answer=PromptUser("Go to buffer byte offset, lines end in \\n: %s (ESC to cancel)",NULL);
+    if (answer==NULL) return;
+    long long off=strtoll(answer,NULL,0);
+    free(answer);
+    if (off<0) off=0;
+    editor.cy=RowAtByteOffset(off);
+    editor.cx=0;
+    if (editor.cy<editor.numrows) {
+        long long cx=off-RowByteOffset(editor.cy);
+        editor.cx=cx>editor.row[editor.cy].size?editor.row[editor.cy].size:cx;
+    }
+    editor.RowOffset=editor.numrows;
+}
+// ordered selection bounds in chars, end exclusive; 0 if nothing is selected
+int SelectionRange(int * y0, int * x0, int * y1, int * x1) {
+    if (!editor.SelectActive || editor.numrows==0) return 0;
+    int ay=editor.SelY,ax=editor.SelX,by=editor.cy,bx=editor.cx;
+    if (ay>=editor.numrows) ay=editor.numrows-1,ax=editor.row[ay].size;
+    if (by>=editor.numrows) by=editor.numrows-1,bx=editor.row[by].size;
+    if (ax>editor.row[ay].size) ax=editor.row[ay].size;
+    if (bx>editor.row[by].size) bx=editor.row[by].size;
+    if (ay>by || (ay==by && ax>bx)) {
+        int t=ay; ay=by; by=t;
+        t=ax; ax=bx; bx=t;
+    }
+    *y0=ay,*x0=ax,*y1=by,*x1=bx;
+    return ay!=by || ax!=bx;
+}
+void FreeClipboard(void) {
+    for (int j=0;j<editor.cliprows;j++) FreeRow(&editor.clip[j]);
+    free(editor.clip);
+    editor.clip=NULL;
+    editor.cliprows=0;
+}
+// row y's chars become the concatenation of a, b and c, which may point into them
+void SetRowChars(int y, char * a, int alen, char * b, int blen, char * c, int clen) {
+    EditorRow * row=&editor.row[y];
+    char * chars=malloc(alen+blen+clen+1);
+    memcpy(chars,a,alen);
+    memcpy(&chars[alen],b,blen);
+    memcpy(&chars[alen+blen],c,clen);
+    chars[alen+blen+clen]='\0';
+    free(row->chars);
+    row->chars=chars;
+    row->size=alen+blen+clen;
+    RenderRow(row);
+    IndexUpdateRow(row);
+    MarkRowDirty(y);
+}
+// rows were spliced in or out at y, so rows after it need new indices and the indexes rebuilding
+void RowsSpliced(int y) {
+    for (int j=y;j<editor.numrows;j++) editor.row[j].idx=j;
+    editor.ByteIndexStale=1;
+    editor.BracketStale=1;
+    if (y<editor.FirstDirtyRow) editor.FirstDirtyRow=y;
+}
+void CopySelection(int cut) {
+    int y0,x0,y1,x1;
+    if (!SelectionRange(&y0,&x0,&y1,&x1)) {
+        SetStatusMsg("Nothing selected (Ctrl-Space to start a selection)");
+        return;
+    }
+    FreeClipboard();
+    int lines=y1-y0+1;
+    editor.clip=malloc(sizeof(EditorRow)*lines);
+    editor.cliprows=lines;
+    EditorRow * first=&editor.row[y0];
+    EditorRow * last=&editor.row[y1];
+    ThawRow(first);
+    ThawRow(last);
+    InitRow(&editor.clip[0],0,&first->chars[x0],(y0==y1?x1:first->size)-x0);
+    if (lines>1) InitRow(&editor.clip[lines-1],lines-1,last->chars,x1);
+    if (!cut) {
+        for (int j=1;j<lines-1;j++) InitRow(&editor.clip[j],j,RowChars(&editor.row[y0+j]),editor.row[y0+j].size);
+        SetStatusMsg("Copied %d line%s",lines,lines==1?"":"s");
+        return;
+    }
+    // whole rows in between move to the clipboard as they are, in one splice
+    memcpy(&editor.clip[1],&editor.row[y0+1],sizeof(EditorRow)*(lines>2?lines-2:0));
+    int state=last->HL_OPEN_COMMENT; // what the row after the cut was lexed with
+    SetRowChars(y0,first->chars,x0,&last->chars[x1],last->size-x1,"",0);
+    if (lines>1) {
+        FreeRow(&editor.row[y1]);
+        memmove(&editor.row[y0+1],&editor.row[y1+1],sizeof(EditorRow)*(editor.numrows-y1-1));
+        editor.numrows-=lines-1;
+        RowsSpliced(y0+1);
+    }
+    editor.row[y0].HL_OPEN_COMMENT=state;
+    RehighlightRows(y0,y0,NULL);
+    editor.dirty++;
+    editor.cy=y0;
+    editor.cx=x0;
+    editor.SelectActive=0;
+    SetStatusMsg("Cut %d line%s",lines,lines==1?"":"s");
+}
+void Paste(void) {
+    if (editor.cliprows==0) {
+        SetStatusMsg("Clipboard is empty");
+        return;
+    }
+    if (editor.cy>editor.numrows) editor.cy=editor.numrows,editor.cx=0; // MoveCursor allows one row past the end
+    if (editor.cy==editor.numrows) NewRow(editor.numrows,"",0);
+    int y=editor.cy;
+    int lines=editor.cliprows;
+    EditorRow * row=&editor.row[y];
+    ThawRow(row);
+    if (editor.cx>row->size) editor.cx=row->size;
+    EditorRow * first=&editor.clip[0];
+    EditorRow * last=&editor.clip[lines-1];
+    int state=row->HL_OPEN_COMMENT; // what the row after the paste was lexed with
+    if (lines==1) {
+        SetRowChars(y,row->chars,editor.cx,first->chars,first->size,&row->chars[editor.cx],row->size-editor.cx);
+        editor.cx+=first->size;
+    } else {
+        // open a gap of lines-1 rows after y in one move, then fill it
+        editor.row=realloc(editor.row,sizeof(EditorRow)*(editor.numrows+lines-1));
+        memmove(&editor.row[y+lines],&editor.row[y+1],sizeof(EditorRow)*(editor.numrows-y-1));
+        editor.numrows+=lines-1;
+        RowsSpliced(y+1);
+        row=&editor.row[y];
+        for (int j=1;j<lines-1;j++) {
+            InitRow(&editor.row[y+j],y+j,RowChars(&editor.clip[j]),editor.clip[j].size);
+            RenderRow(&editor.row[y+j]);
+            editor.row[y+j].dirty=1;
+        }
+        InitRow(&editor.row[y+lines-1],y+lines-1,"",0);
+        SetRowChars(y+lines-1,last->chars,last->size,&row->chars[editor.cx],row->size-editor.cx,"",0);
+        SetRowChars(y,row->chars,editor.cx,first->chars,first->size,"",0);
+        editor.cy=y+lines-1;
+        editor.cx=last->size;
+    }
+    editor.row[y+lines-1].HL_OPEN_COMMENT=state;
+    RehighlightRows(y,y+lines-1,NULL);
+    editor.dirty++;
+    SetStatusMsg("Pasted %d line%s",lines,lines==1?"":"s");
+}
+void ToggleSelection(void) {
+    editor.SelectActive=!editor.SelectActive;
+    editor.SelY=editor.cy;
+    editor.SelX=editor.cx;
+    SetStatusMsg(editor.SelectActive?"Selection started, Ctrl-X to cut, Ctrl-C to copy":"Selection cleared");
+}
 void ProcessKey(void) {
     static int QuitTimes=TEDIT_QUIT_TIME;
     int cur=ReadKey();
@@ -682,7 +1513,9 @@ void ProcessKey(void) {
             if (editor.cy<editor.numrows) editor.cx=editor.row[editor.cy].size;
             break;
         case ctrl('l'):
+            break;
         case '\x1b':
+            editor.SelectActive=0;
             break;
         case ctrl('s'):
             SaveFile();
@@ -690,6 +1523,33 @@ void ProcessKey(void) {
         case ctrl('f'):
             FindStr();
             break;
+        case ctrl('r'):
+            ReplaceAll();
+            break;
+        case ctrl('g'):
+            GotoLine();
+            break;
+        case ctrl('o'):
+            GotoOffset();
+            break;
+        case ctrl('b'):
+            JumpToBracket();
+            break;
+        case ctrl('@'):
+            ToggleSelection();
+            break;
+        case ctrl('x'):
+            CopySelection(1);
+            break;
+        case ctrl('c'):
+            CopySelection(0);
+            break;
+        case ctrl('v'):
+            Paste();
+            break;
+        case ctrl('t'):
+            ShowMemoryStats();
+            break;
         default:
             InsertChar(cur);
             break;
@@ -725,6 +1585,8 @@ int WinSize(int * rows, int * columns) {
 }
 void TildeColumn(struct AppendBuffer *ab) {
     int y;
+    int y0,x0,y1,x1;
+    int selected=SelectionRange(&y0,&x0,&y1,&x1);
     for (y = 0; y < editor.screenrows-2; y++) {
         int filerow = y + editor.RowOffset;
         char buf[32];
@@ -749,15 +1611,28 @@ void TildeColumn(struct AppendBuffer *ab) {
                 AppendAB(ab, "~", 1);
             }
         } else {
+            EnsureHighlight(&editor.row[filerow]);
             int len = editor.row[filerow].RenderSize - editor.ColumnOffset;
             if (len < 0) len = 0;
             if (len > editor.screencols) len = editor.screencols;
             char *c = &editor.row[filerow].render[editor.ColumnOffset];
             unsigned char *hl = &editor.row[filerow].hl[editor.ColumnOffset];
             int CurrentColor=-1;
+            int SelStart=0,SelEnd=0; // selected render columns of this row
+            if (selected && filerow>=y0 && filerow<=y1) {
+                SelStart=filerow==y0?CharsToRender(&editor.row[filerow],x0):0;
+                SelEnd=filerow==y1?CharsToRender(&editor.row[filerow],x1):editor.row[filerow].RenderSize;
+            }
             int j;
             for (j = 0; j < len; j++) {
-                if (iscntrl(c[j])) {
+                int rx=j+editor.ColumnOffset;
+                if ((filerow==editor.PairRow[0] && rx==editor.PairRx[0]) || (filerow==editor.PairRow[1] && rx==editor.PairRx[1]) ||
+                    (rx>=SelStart && rx<SelEnd)) {
+                    AppendAB(ab, "\x1b[7m", 4);
+                    AppendAB(ab, &c[j], 1);
+                    AppendAB(ab, "\x1b[m", 3);
+                    CurrentColor=-1;
+                } else if (iscntrl(c[j])) {
                     char sym=(c[j]<=26) ? '@'+c[j]:'?';
                     AppendAB(ab, "\x1b[7m", 4);
                     AppendAB(ab, &sym, 1);
@@ -785,38 +1660,495 @@ void TildeColumn(struct AppendBuffer *ab) {
         AppendAB(ab, "\r\n", 2);
     }
 }
-char * RowsToString(int * buflen) {
-    int totlen=0;
-    for (int j=0;j<editor.numrows;j++) {
+char * RowsToString(int from, size_t * buflen) {
+    size_t totlen=0;
+    for (int j=from;j<editor.numrows;j++) {
         totlen+=editor.row[j].size+1;
     }
     *buflen=totlen;
-    char * buf=malloc(totlen);
+    char * buf=malloc(totlen?totlen:1);
     char * p=buf;
-    for (int j=0;j<editor.numrows;j++) {
-        memcpy(p,editor.row[j].chars,editor.row[j].size);
+    for (int j=from;j<editor.numrows;j++) {
+        memcpy(p,RowChars(&editor.row[j]),editor.row[j].size);
         p+=editor.row[j].size;
         *p='\n';
         p++;
     }
     return buf;
 }
-void OpenFile(char * filename) {
-    free(editor.filename);
-    editor.filename=strdup(filename);
-    SelectSyntaxHighlighter();
-    FILE * fp=fopen(filename,"r");
-    if (!fp) die("fopen");
+size_t CountNewlines(const char * p, size_t n) {
+    size_t count=0;
+    size_t i=0;
+#ifdef __SSE2__
+    const __m128i nl=_mm_set1_epi8('\n');
+    for (;i+16<=n;i+=16) {
+        __m128i v=_mm_loadu_si128((const __m128i *)(p+i));
+        count+=__builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v,nl)));
+    }
+#endif
+    for (;i<n;i++) count+=(p[i]=='\n');
+    return count;
+}
+struct LoadJob {
+    char * buf;
+    size_t size;
+    size_t start;
+    size_t end;
+    size_t newlines; // in [start,end), then rows before start
+    int base; // first row of the editor being loaded into
+    int stripped; // a row lost a trailing \r
+    uint64_t * starts; // offset in buf of each row from base on, or NULL
+};
+void * CountWorker(void * arg) {
+    struct LoadJob * job=arg;
+    job->newlines=CountNewlines(job->buf+job->start,job->end-job->start);
+    return NULL;
+}
+void * SplitWorker(void * arg) {
+    struct LoadJob * job=arg;
+    char * buf=job->buf;
+    size_t q=job->start;
+    int at=job->base+job->newlines;
+    if (q>0 && buf[q-1]!='\n') {
+        char * nl=memchr(buf+q,'\n',job->end-q);
+        if (nl==NULL) return NULL; // every line here started in an earlier chunk
+        q=nl-buf+1;
+        at++;
+    }
+    // rows that start in this chunk, which may run past its end
+    while (q<job->end && q<job->size) {
+        char * nl=memchr(buf+q,'\n',job->size-q);
+        size_t e=nl?(size_t)(nl-buf):job->size;
+        size_t len=e-q;
+        while (len>0 && buf[q+len-1]=='\r') len--;
+        if (len<e-q) job->stripped=1;
+        EditorRow * row=&editor.row[at];
+        if (job->starts) job->starts[at-job->base]=q;
+        InitRow(row,at,buf+q,len);
+        RenderRow(row);
+        HighlightRow(row,0);
+        at++;
+        q=e+1;
+    }
+    return NULL;
+}
+// append the lines of buf as rows, counting and splitting them on all cores; if starts
+// is given it receives a malloced array of each new row's offset in buf
+void LoadRows(char * buf, size_t size, uint64_t ** starts) {
+    struct LoadJob jobs[TEDIT_MAX_THREADS];
+    int n=WorkerCount(size/TEDIT_LOAD_CHUNK);
+    for (int t=0;t<n;t++) {
+        jobs[t].buf=buf;
+        jobs[t].size=size;
+        jobs[t].start=size*t/n;
+        jobs[t].end=size*(t+1)/n;
+        jobs[t].base=editor.numrows;
+        jobs[t].stripped=0;
+    }
+    RunJobs(CountWorker,jobs,sizeof(jobs[0]),n);
+    size_t rows=0;
+    for (int t=0;t<n;t++) {
+        size_t c=jobs[t].newlines;
+        jobs[t].newlines=rows;
+        rows+=c;
+    }
+    if (size>0 && buf[size-1]!='\n') rows++;
+    editor.row=realloc(editor.row,sizeof(EditorRow)*(editor.numrows+rows));
+    if (rows && editor.row==NULL) die("realloc");
+    if (starts) *starts=malloc(sizeof(uint64_t)*(rows?rows:1));
+    for (int t=0;t<n;t++) jobs[t].starts=starts?*starts:NULL;
+    RunJobs(SplitWorker,jobs,sizeof(jobs[0]),n);
+    for (int t=0;t<n;t++) editor.StrippedCR|=jobs[t].stripped;
+    editor.numrows+=rows;
+    editor.ResidentBytes+=RowsCost(editor.numrows-rows,editor.numrows);
+    editor.PackSweep=0;
+    editor.ByteIndexStale=1;
+    editor.BracketStale=1;
+    // each row was lexed as if no comment were open, carry open comments across them in order
+    for (int i=editor.numrows-rows;i<editor.numrows;i++) {
+        if (i>0 && editor.row[i-1].HL_OPEN_COMMENT) HighlightRow(&editor.row[i],1);
+    }
+}
+void * StreamReader(void * arg) {
+    char * block=malloc(TEDIT_STREAM_BLOCK);
+    while (1) {
+        ssize_t n=read(stream.fd,block,TEDIT_STREAM_BLOCK);
+        if (n==-1 && errno==EINTR) continue;
+        pthread_mutex_lock(&stream.lock);
+        while (n>0 && stream.pending.len>=TEDIT_STREAM_BLOCK*TEDIT_STREAM_BACKLOG) pthread_cond_wait(&stream.drained,&stream.lock);
+        if (n>0) AppendAB(&stream.pending,block,n);
+        else stream.done=1;
+        pthread_mutex_unlock(&stream.lock);
+        if (n<=0) break;
+    }
+    free(block);
+    return arg;
+}
+// read rows from stdin in the background, taking keys from the terminal instead
+void OpenStdin(void) {
+    if (isatty(STDIN_FILENO)) {
+        // the reader would steal keystrokes from ReadKey
+        fprintf(stderr,"tedit: - reads a pipe, but stdin is a terminal\n");
+        exit(1);
+    }
+    stream.fd=dup(STDIN_FILENO);
+    int tty=open("/dev/tty",O_RDWR);
+    if (stream.fd==-1 || tty==-1 || dup2(tty,STDIN_FILENO)==-1) die("/dev/tty");
+    close(tty);
+    stream.used=1;
+}
+void StartStream(void) {
+    if (stream.fd==-1) return;
+    if (pthread_create(&stream.reader,NULL,StreamReader,NULL)!=0) die("pthread_create");
+    stream.active=1;
+}
+// append whatever the reader has delivered, returns 1 if the screen needs redrawing
+int StreamPoll(void) {
+    if (!stream.active) return 0;
+    pthread_mutex_lock(&stream.lock);
+    struct AppendBuffer block=stream.pending;
+    int done=stream.done;
+    stream.pending.b=NULL;
+    stream.pending.len=0;
+    pthread_cond_signal(&stream.drained);
+    pthread_mutex_unlock(&stream.lock);
+    if (block.len==0 && !done) return 0;
+    if (block.len) AppendAB(&stream.carry,block.b,block.len);
+    FreeAB(&block);
+    char * last=NULL;
+    for (int i=stream.carry.len-1;i>=0 && last==NULL;i--) {
+        if (stream.carry.b[i]=='\n') last=&stream.carry.b[i];
+    }
+    if (done) {
+        LoadRows(stream.carry.b,stream.carry.len,NULL);
+        FreeAB(&stream.carry);
+        pthread_join(stream.reader,NULL);
+        close(stream.fd);
+        stream.active=0;
+    } else if (last) {
+        int len=last-stream.carry.b+1;
+        LoadRows(stream.carry.b,len,NULL);
+        memmove(stream.carry.b,last+1,stream.carry.len-len);
+        stream.carry.len-=len;
+    }
+    return 1;
+}
+void LoadRowsStdio(FILE * fp) {
     char * line=NULL;
     size_t linecap=0;
     ssize_t linelen;
     while ((linelen = getline(&line, &linecap, fp)) != -1) {
         while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) linelen--;
+        if (line[linelen]=='\r') editor.StrippedCR=1;
         NewRow(editor.numrows,line, linelen);
+        editor.row[editor.numrows-1].dirty=0;
     }
     free(line);
+}
+uint64_t HashBytes(uint64_t h, const void * p, size_t n) {
+    const unsigned char * b=p;
+    for (size_t i=0;i<n;i++) h=(h^b[i])*1099511628211ULL; // FNV-1a
+    return h;
+}
+#define TEDIT_CACHE_SAMPLES 16
+#define TEDIT_CACHE_SAMPLE 4096
+// content hash over evenly spaced samples, so checking a cache costs the same for any file size
+uint64_t SampleHash(char * buf, size_t size) {
+    uint64_t h=HashBytes(14695981039346656037ULL,&size,sizeof(size));
+    for (int i=0;i<TEDIT_CACHE_SAMPLES;i++) {
+        size_t at=size<=TEDIT_CACHE_SAMPLE?0:(size-TEDIT_CACHE_SAMPLE)/(TEDIT_CACHE_SAMPLES-1)*i;
+        if (i==TEDIT_CACHE_SAMPLES-1 && size>TEDIT_CACHE_SAMPLE) at=size-TEDIT_CACHE_SAMPLE;
+        h=HashBytes(h,buf+at,size-at<TEDIT_CACHE_SAMPLE?size-at:TEDIT_CACHE_SAMPLE);
+    }
+    return h;
+}
+struct CacheHeader {
+    char magic[8];
+    uint64_t size;
+    int64_t mtime;
+    int64_t mtimensec;
+    uint64_t hash;
+    int32_t syntax; // index into HighlightDatabase, -1 for none
+    int32_t numrows;
+    int32_t pathlen;
+    int32_t pad;
+};
+// followed by numrows row starts (uint64), sizes (int32), bracket summaries,
+// a bitmap of HL_OPEN_COMMENT states and finally the file's path
+#define TEDIT_CACHE_MAGIC "tedit01"
+// cache file for filename in $TEDIT_CACHE_DIR, or NULL when caching is off
+char * CachePath(char * filename, char ** realname) {
+    char * dir=getenv("TEDIT_CACHE_DIR");
+    if (dir==NULL || *dir=='\0') return NULL;
+    *realname=realpath(filename,NULL);
+    if (*realname==NULL) return NULL;
+    uint64_t key=HashBytes(14695981039346656037ULL,*realname,strlen(*realname));
+    mkdir(dir,0700);
+    size_t len=strlen(dir)+32;
+    char * path=malloc(len);
+    snprintf(path,len,"%s/%016llx.tc",dir,(unsigned long long)key);
+    return path;
+}
+int SyntaxIndex(SyntaxInfo * s) {
+    return s?(int)(s-HighlightDatabase):-1;
+}
+struct CacheJob {
+    char * buf;
+    uint64_t * starts;
+    int32_t * sizes;
+    BracketSpan * brackets;
+    unsigned char * states;
+    int start;
+    int end; // cut short to the rows built when stale is set
+    int stale;
+};
+void * CacheWorker(void * arg) {
+    struct CacheJob * job=arg;
+    for (int i=job->start;i<job->end;i++) {
+        char * chars=job->buf+job->starts[i];
+        int size=job->sizes[i];
+        // a newline added inside a row, or a CR LoadRows would have stripped
+        if (memchr(chars,'\n',size) || (size>0 && chars[size-1]=='\r')) {
+            job->stale=1;
+            job->end=i;
+            break;
+        }
+        EditorRow * row=&editor.row[i];
+        InitRow(row,i,chars,size);
+        RenderRow(row);
+        row->HL_OPEN_COMMENT=(job->states[i/8]>>(i%8))&1;
+        row->BracketNet=job->brackets[i].net;
+        row->BracketMin=job->brackets[i].min;
+        row->NeedsHighlight=1;
+    }
+    return NULL;
+}
+// build the rows of buf from a valid cache, returns 0 if there is none or it is stale
+int LoadCache(char * filename, struct stat * st, char * buf) {
+    char * realname=NULL;
+    char * path=CachePath(filename,&realname);
+    if (path==NULL) return 0;
+    int ok=0;
+    int fd=open(path,O_RDONLY);
+    struct stat cst;
+    struct CacheHeader h;
+    if (fd!=-1 && fstat(fd,&cst)==0 && cst.st_size>=(off_t)sizeof(h) && read(fd,&h,sizeof(h))==sizeof(h) &&
+        !memcmp(h.magic,TEDIT_CACHE_MAGIC,8) && h.size==(uint64_t)st->st_size &&
+        h.mtime==st->st_mtim.tv_sec && h.mtimensec==st->st_mtim.tv_nsec &&
+        h.syntax==SyntaxIndex(SyntaxForFilename(editor.filename)) && h.numrows>=0 &&
+        h.pathlen==(int32_t)strlen(realname)) {
+        size_t n=h.numrows;
+        size_t bodylen=n*(sizeof(uint64_t)+sizeof(int32_t)+sizeof(BracketSpan))+(n+7)/8+h.pathlen;
+        char * c=(cst.st_size==(off_t)(sizeof(h)+bodylen))?mmap(NULL,cst.st_size,PROT_READ,MAP_PRIVATE,fd,0):MAP_FAILED;
+        if (c!=MAP_FAILED) {
+            struct CacheJob job;
+            job.buf=buf;
+            job.starts=(uint64_t *)(c+sizeof(h));
+            job.sizes=(int32_t *)(job.starts+n);
+            job.brackets=(BracketSpan *)(job.sizes+n);
+            job.states=(unsigned char *)(job.brackets+n);
+            ok=!memcmp(job.states+(n+7)/8,realname,h.pathlen) && h.hash==SampleHash(buf,st->st_size);
+            // rows must tile the file, each ended by \r*\n or, for the last, the end of the file
+            uint64_t next=0;
+            int stripped=0;
+            for (size_t i=0;ok && i<n;i++) {
+                uint64_t at=job.starts[i];
+                if (job.sizes[i]<0 || at!=next || at>=h.size || (uint64_t)job.sizes[i]>h.size-at) {
+                    ok=0;
+                    break;
+                }
+                uint64_t e=at+job.sizes[i];
+                while (e<h.size && buf[e]=='\r') e++;
+                if (e>at+job.sizes[i]) stripped=1;
+                if (e<h.size && buf[e]!='\n') ok=0;
+                next=e<h.size?e+1:e;
+            }
+            if (next!=h.size) ok=0;
+            if (ok) {
+                struct CacheJob jobs[TEDIT_MAX_THREADS];
+                int threads=WorkerCount(n/TEDIT_HL_CHUNK);
+                for (int t=0;t<threads;t++) {
+                    jobs[t]=job;
+                    jobs[t].start=editor.numrows+n*t/threads;
+                    jobs[t].end=editor.numrows+n*(t+1)/threads;
+                    jobs[t].stale=0;
+                }
+                editor.row=realloc(editor.row,sizeof(EditorRow)*(editor.numrows+n));
+                if (n && editor.row==NULL) die("realloc");
+                RunJobs(CacheWorker,jobs,sizeof(jobs[0]),threads);
+                for (int t=0;t<threads;t++) {
+                    editor.ResidentBytes+=RowsCost(jobs[t].start,jobs[t].end);
+                    if (jobs[t].stale) ok=0;
+                }
+                if (ok) {
+                    editor.numrows+=n;
+                    editor.StrippedCR|=stripped;
+                    editor.PackSweep=0;
+                    editor.ByteIndexStale=1;
+                    editor.BracketStale=1;
+                } else {
+                    for (int t=0;t<threads;t++) {
+                        for (int i=jobs[t].start;i<jobs[t].end;i++) FreeRow(&editor.row[i]);
+                    }
+                }
+            }
+            munmap(c,cst.st_size);
+        }
+    }
+    if (fd!=-1) close(fd);
+    free(path);
+    free(realname);
+    return ok;
+}
+// record row offsets and highlight state of a freshly loaded file for the next open
+void SaveCache(char * filename) {
+    uint64_t * starts=editor.RowStarts; // found by LoadRows, so the file is not scanned again
+    editor.RowStarts=NULL;
+    char * realname=NULL;
+    char * path=CachePath(filename,&realname);
+    if (path==NULL) {
+        free(starts);
+        return;
+    }
+    int fd=open(filename,O_RDONLY);
+    struct stat st;
+    char * buf=MAP_FAILED;
+    if (fd!=-1 && fstat(fd,&st)==0 && S_ISREG(st.st_mode) && st.st_size>=TEDIT_CACHE_MIN &&
+        st.st_size==editor.DiskSize && st.st_mtim.tv_sec==editor.DiskMtime.tv_sec && st.st_mtim.tv_nsec==editor.DiskMtime.tv_nsec)
+        buf=mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    if (buf!=MAP_FAILED && starts) {
+        size_t n=editor.numrows;
+        char * tmp=malloc(strlen(path)+8);
+        sprintf(tmp,"%s.tmp",path);
+        FILE * fp=fopen(tmp,"w");
+        if (fp) {
+            struct CacheHeader h;
+            memset(&h,0,sizeof(h));
+            memcpy(h.magic,TEDIT_CACHE_MAGIC,8);
+            h.size=st.st_size;
+            h.mtime=st.st_mtim.tv_sec;
+            h.mtimensec=st.st_mtim.tv_nsec;
+            h.hash=SampleHash(buf,st.st_size);
+            h.syntax=SyntaxIndex(editor.syntax);
+            h.numrows=n;
+            h.pathlen=strlen(realname);
+            fwrite(&h,sizeof(h),1,fp);
+            fwrite(starts,sizeof(uint64_t),n,fp);
+            for (size_t i=0;i<n;i++) {
+                int32_t size=editor.row[i].size;
+                fwrite(&size,sizeof(size),1,fp);
+            }
+            for (size_t i=0;i<n;i++) {
+                BracketSpan span={editor.row[i].BracketNet,editor.row[i].BracketMin};
+                fwrite(&span,sizeof(span),1,fp);
+            }
+            for (size_t i=0;i<n;i+=8) {
+                unsigned char bits=0;
+                for (size_t j=i;j<i+8 && j<n;j++) bits|=(editor.row[j].HL_OPEN_COMMENT!=0)<<(j-i);
+                fputc(bits,fp);
+            }
+            fwrite(realname,1,h.pathlen,fp);
+            if (fclose(fp)==0) rename(tmp,path);
+            else unlink(tmp);
+        }
+        free(tmp);
+    }
+    if (buf!=MAP_FAILED) munmap(buf,st.st_size);
+    free(starts);
+    if (fd!=-1) close(fd);
+    free(path);
+    free(realname);
+}
+// load filename's rows, returns 1 if they came from the cache with highlight state
+int LoadFile(char * filename, int usecache) {
+    int fd=open(filename,O_RDONLY);
+    if (fd==-1) die("open");
+    struct stat st;
+    editor.DiskSize=-1;
+    if (fstat(fd,&st)==0 && S_ISREG(st.st_mode) && st.st_size>0) {
+        char * buf=mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+        if (buf!=MAP_FAILED) {
+            int cacheable=usecache && st.st_size>=TEDIT_CACHE_MIN && getenv("TEDIT_CACHE_DIR");
+            int cached=cacheable && LoadCache(filename,&st,buf);
+            if (!cached) {
+                madvise(buf,st.st_size,MADV_SEQUENTIAL);
+                LoadRows(buf,st.st_size,cacheable?&editor.RowStarts:NULL); // kept for SaveCache
+            }
+            munmap(buf,st.st_size);
+            close(fd);
+            editor.DiskSize=st.st_size;
+            editor.DiskMtime=st.st_mtim;
+            return cached;
+        }
+    }
+    FILE * fp=fdopen(fd,"r"); // pipes, devices and the like
+    if (!fp) die("fdopen");
+    LoadRowsStdio(fp);
     fclose(fp);
+    return 0;
+}
+void OpenFile(char * filename) {
+    free(editor.filename);
+    editor.filename=strdup(filename);
+    editor.syntax=NULL; // highlight once, in parallel, after loading
+    editor.StrippedCR=0;
+    if (LoadFile(filename,1)) {
+        editor.syntax=SyntaxForFilename(editor.filename);
+    } else {
+        SelectSyntaxHighlighter();
+        SaveCache(filename);
+    }
     editor.dirty=0;
+    editor.FirstDirtyRow=INT_MAX;
+    // stripped CRs mean the rows no longer serialize to the bytes on disk
+    if (editor.StrippedCR) editor.DiskSize=-1;
+}
+double Seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec+ts.tv_nsec/1e9;
+}
+// tedit --bench FILE: compare load throughput of the getline and mmap paths
+int BenchLoad(char * filename) {
+    struct stat st;
+    if (stat(filename,&st)==-1 || st.st_size==0) {
+        perror(filename);
+        return 1;
+    }
+    for (int path=0;path<2;path++) {
+        double best=0;
+        int rows=0;
+        for (int iter=0;iter<3;iter++) {
+            double t0=Seconds();
+            if (path==0) {
+                FILE * fp=fopen(filename,"r");
+                if (!fp) die("fopen");
+                LoadRowsStdio(fp);
+                fclose(fp);
+            } else {
+                LoadFile(filename,0);
+            }
+            double t=Seconds()-t0;
+            if (best==0 || t<best) best=t;
+            rows=editor.numrows;
+            FreeRows();
+        }
+        printf("%-14s %d rows, %.3f s, %.2f GB/s\n",path==0?"getline:":"mmap+threads:",rows,best,st.st_size/best/1e9);
+    }
+    return 0;
+}
+int WriteAll(int fd, char * buf, size_t len, off_t offset) {
+    while (len>0) {
+        ssize_t n=pwrite(fd,buf,len,offset);
+        if (n==-1) {
+            if (errno==EINTR) continue;
+            return -1;
+        }
+        buf+=n;
+        len-=n;
+        offset+=n;
+    }
+    return 0;
 }
 void SaveFile(void) {
     if (editor.filename == NULL) {
@@ -825,25 +2157,43 @@ void SaveFile(void) {
             SetStatusMsg("Aborted Save Operation");
             return;
         }
+        editor.DiskSize=-1;
         SelectSyntaxHighlighter();
     }
-    int len;
-    char *buf = RowsToString(&len);
     int fd = open(editor.filename, O_RDWR | O_CREAT, 0644);
     if (fd != -1) {
-        if (ftruncate(fd, len) != -1) {
-            if (write(fd, buf, len) == len) {
-                close(fd);
-                free(buf);
-                SetStatusMsg("%d bytes written to disk", len);
-                editor.dirty=0;
-                refresh();
-                return;
-            }
+        // if the file is still the one we loaded or last saved, only the rows
+        // from the first modified one onward need to be written
+        struct stat st;
+        int from=0;
+        long long offset=0;
+        if (editor.DiskSize!=-1 && fstat(fd,&st)==0 && st.st_size==editor.DiskSize &&
+            st.st_mtim.tv_sec==editor.DiskMtime.tv_sec && st.st_mtim.tv_nsec==editor.DiskMtime.tv_nsec) {
+            from=editor.FirstDirtyRow<editor.numrows?editor.FirstDirtyRow:editor.numrows;
+            offset=RowByteOffset(from);
+            if (offset>editor.DiskSize) from=0,offset=0;
+        }
+        size_t len;
+        char *buf = RowsToString(from,&len);
+        if (WriteAll(fd, buf, len, offset) != -1 && ftruncate(fd, offset+len) != -1) {
+            if (fstat(fd,&st)==0) {
+                editor.DiskSize=st.st_size;
+                editor.DiskMtime=st.st_mtim;
+            } else editor.DiskSize=-1;
+            close(fd);
+            free(buf);
+            for (int j=from;j<editor.numrows;j++) editor.row[j].dirty=0;
+            editor.FirstDirtyRow=INT_MAX;
+            editor.PackSweep=0; // saved rows can be packed now
+            if (offset) SetStatusMsg("%zu bytes written to disk from byte %lld", len, offset);
+            else SetStatusMsg("%zu bytes written to disk", len);
+            editor.dirty=0;
+            refresh();
+            return;
         }
+        free(buf);
         close(fd);
     }
-    free(buf);
     SetStatusMsg("I/O error: %s",strerror(errno));
     editor.dirty=0;
     refresh();
@@ -861,16 +2211,42 @@ void init(void) {
     editor.dirty=0;
     editor.StatusMsg[0]='\0';
     editor.syntax=NULL;
+    editor.ByteIndex=NULL;
+    editor.ByteIndexStale=1;
+    editor.FirstDirtyRow=INT_MAX;
+    editor.DiskSize=-1;
+    editor.StrippedCR=0;
+    editor.RowStarts=NULL;
+    editor.BracketTree=NULL;
+    editor.BracketStale=1;
+    editor.PairRow[0]=editor.PairRow[1]=-1;
+    editor.SelectActive=0;
+    editor.clip=NULL;
+    editor.cliprows=0;
+    char * budget=getenv("TEDIT_MEMORY_MB");
+    editor.MemoryBudget=(budget?atoll(budget):TEDIT_MEMORY_MB)<<20;
+    editor.ResidentBytes=editor.PackedBytes=0;
+    editor.PackedRows=editor.PackedBlocks=0;
+    editor.InBulk=0;
+    editor.Compacting=0;
+    editor.PackCursor=editor.PackSweep=0;
+    editor.Unpacked=NULL;
+    editor.UnpackedRaw=NULL;
     if (WinSize(&editor.screenrows,&editor.screencols)==-1) die("WinSize");
 }
 int main(int argc, char ** argv) {
+    if (argc>=3 && !strcmp(argv[1],"--bench")) return BenchLoad(argv[2]);
+    if (argc>=2 && !strcmp(argv[1],"-")) OpenStdin();
     RawMode();
     init();
-    if (argc>=2) {
+    if (stream.used) {
+        StartStream();
+    } else if (argc>=2) {
         OpenFile(argv[1]);
     }
     SetStatusMsg("Ctrl-Q to Quit");
     while (true) {
+        CompactRows();
         refresh();
         ProcessKey();
     }